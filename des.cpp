@@ -12,10 +12,47 @@
 //                      if anything does not work correctly and you would like to see what is happening
 //                      in binary. Other than that, if one understands the steps of DES encryption/decryption,
 //                      it is easy to read through the code and see what is happening.
+//
+//                      The block engine (buildKeySchedule + transformBlocks) can also be driven from
+//                      a C++20 coroutine through transformAsync, which runs large buffers in chunks on
+//                      a DesExecutor thread so an event loop is never stalled by a big payload.
+//                      DesStreamBuf puts the same engine behind any std::streambuf, encrypting what is
+//                      written through it and decrypting what is read. Those, the buffer pool and
+//                      the shared-memory ring client are declared in des.h for other programs to use.
+//
+//                      Compile with: g++ -std=c++20 -O2 -pthread des.cpp -o des
 
 #include <iostream>
 #include <string.h>
 #include <fstream>
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <coroutine>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <map>
+#include <random>
+#include <mutex>
+#include <new>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#include "des.h"
 
 using namespace std;
 
@@ -35,75 +72,278 @@ int getColIndex(int,int,int,int);
 string getZeroString(int);
 int getBit(int,string);
 void putBit(int,int,string&);
-void writeToFile(string,string);
-string getFileText(string);
+void writeToFile(string,const char*,size_t);
+struct CompressionHeader;
+struct ShmRingSlot;
+PooledBuffer getFileText(string,size_t);
 void outputKey(string);
 void outputBits(string,int);
+void printUsage();
+string formatMetrics(bool);
+size_t compressBound(size_t);
+size_t compressText(const char*,size_t,char*);
+bool decompressText(const char*,size_t,PooledBuffer&,size_t);
+size_t lz4CompressBlock(const unsigned char*,size_t,unsigned char*);
+bool lz4DecompressBlock(const unsigned char*,size_t,unsigned char*,size_t);
+void writeCompressionHeader(char*,int,uint64_t,uint64_t);
+bool readCompressionHeader(const char*,size_t,CompressionHeader&);
+int serveShmRing(string,string,int);
+ShmRingSlot* shmRingSlot(ShmRing&,uint32_t);
+void futexWait(atomic<uint32_t>&,uint32_t,const timespec* = nullptr);
+void futexWake(atomic<uint32_t>&);
+void buildSpTables();
+string spBoxPermutation(string,int);
+string defaultProfilePath();
+bool loadTuneProfile(string);
+double measureThroughput(int);
+int tuneEngine(string);
+void writeMetricsFile(string);
+
+const char* const invalidKeyMessage = "Invalid key length. The key must be an 8-character string";
+
+const int sBoxTables[8][4][16] = {{{14,  4, 13,  1,  2, 15, 11,  8,  3, 10,  6, 12,  5,  9,  0,  7},
+                                   { 0, 15,  7,  4, 14,  2, 13,  1, 10,  6, 12, 11,  9,  5,  3,  8},
+                                   { 4,  1, 14,  8, 13,  6,  2, 11, 15, 12,  9,  7,  3, 10,  5,  0},
+                                   {15, 12,  8,  2,  4,  9,  1,  7,  5, 11,  3, 14, 10,  0,  6, 13}},  // end s-box 1
+               
+                                  {{15,  1,  8, 14,  6, 11,  3,  4,  9,  7,  2, 13, 12,  0,  5, 10},
+                                   { 3, 13,  4,  7, 15,  2,  8, 14, 12,  0,  1, 10,  6,  9, 11,  5},
+                                   { 0, 14,  7, 11, 10,  4, 13,  1,  5,  8, 12,  6,  9,  3,  2, 15},
+                                   {13,  8, 10,  1,  3, 15,  4,  2, 11,  6,  7, 12,  0,  5, 14,  9}},  // end s-box 2
+
+                                  {{10,  0,  9, 14,  6,  3, 15,  5,  1, 13, 12,  7, 11,  4,  2,  8},
+                                   {13,  7,  0,  9,  3,  4,  6, 10,  2,  8,  5, 14, 12, 11, 15,  1},
+                                   {13,  6,  4,  9,  8, 15,  3,  0, 11,  1,  2, 12,  5, 10, 14,  7},
+                                   { 1, 10, 13,  0,  6,  9,  8,  7,  4, 15, 14,  3, 11,  5,  2, 12}},  // end s-box 3
+
+                                  {{ 7, 13, 14,  3,  0,  6,  9, 10,  1,  2,  8,  5, 11, 12,  4, 15},
+                                   {13,  8, 11,  5,  6, 15,  0,  3,  4,  7,  2, 12,  1, 10, 14,  9},
+                                   {10,  6,  9,  0, 12, 11,  7, 13, 15,  1,  3, 14,  5,  2,  8,  4},
+                                   { 3, 15,  0,  6, 10,  1, 13,  8,  9,  4,  5, 11, 12,  7,  2, 14}},  // end s-box 4
+
+                                  {{ 2, 12,  4,  1,  7, 10, 11,  6,  8,  5,  3, 15, 13,  0, 14,  9},
+                                   {14, 11,  2, 12,  4,  7, 13,  1,  5,  0, 15, 10,  3,  9,  8,  6},
+                                   { 4,  2,  1, 11, 10, 13,  7,  8, 15,  9, 12,  5,  6,  3,  0, 14},
+                                   {11,  8, 12,  7,  1, 14,  2, 13,  6, 15,  0,  9, 10,  4,  5,  3}},  // end s-box 5  
+
+                                  {{12,  1, 10, 15,  9,  2,  6,  8,  0, 13,  3,  4, 14,  7,  5, 11},
+                                   {10, 15,  4,  2,  7, 12,  9,  5,  6,  1, 13, 14,  0, 11,  3,  8},
+                                   { 9, 14, 15,  5,  2,  8, 12,  3,  7,  0,  4, 10,  1, 13, 11,  6},
+                                   { 4,  3,  2, 12,  9,  5, 15, 10, 11, 14,  1,  7,  6,  0,  8, 13}},  // end s-box 6
+
+                                  {{ 4, 11,  2, 14, 15,  0,  8, 13,  3, 12,  9,  7,  5, 10,  6,  1},
+                                   {13,  0, 11,  7,  4,  9,  1, 10, 14,  3,  5, 12,  2, 15,  8,  6},
+                                   { 1,  4, 11, 13, 12,  3,  7, 14, 10, 15,  6,  8,  0,  5,  9,  2},
+                                   { 6, 11, 13,  8,  1,  4, 10,  7,  9,  5,  0, 15, 14,  2,  3, 12}},  // end s-box 7
+
+                                  {{13,  2,  8,  4,  6, 15, 11,  1, 10,  9,  3, 14,  5,  0, 12,  7},
+                                   { 1, 15, 13,  8, 10,  3,  7,  4, 12,  5,  6, 11,  0, 14,  9,  2},
+                                   { 7, 11,  4,  1,  9, 12, 14,  2,  0,  6, 10, 13, 15,  3,  5,  8},
+                                   { 2,  1, 14,  7,  4, 10,  8, 13, 15, 12,  9,  0,  3,  5,  6, 11}}}; // end s-sbox 8
 
+//==========================================================================================================================
+//end s-table declaration
 
-int main(int argc, char** argv)
+//===============================================================================
+// Metrics
+//
+// Counters are bumped by the engine (transformBlocks), the file helpers and the
+// key schedule cache, and written out by writeMetricsFile as Prometheus text, or
+// as JSON when the file name ends in ".json". A MetricsReporter rewrites the file
+// every intervalSeconds while the program runs and once more when it goes away.
+
+struct DesThreadMetrics
 {
+     int threadNo = 0;
+     atomic<uint64_t> bytesProcessed{0};
+     atomic<uint64_t> cipherNanos{0};
+};
 
-     const int sBoxTables[8][4][16] = {{{14,  4, 13,  1,  2, 15, 11,  8,  3, 10,  6, 12,  5,  9,  0,  7},
-                                        { 0, 15,  7,  4, 14,  2, 13,  1, 10,  6, 12, 11,  9,  5,  3,  8},
-                                        { 4,  1, 14,  8, 13,  6,  2, 11, 15, 12,  9,  7,  3, 10,  5,  0},
-                                        {15, 12,  8,  2,  4,  9,  1,  7,  5, 11,  3, 14, 10,  0,  6, 13}},  // end s-box 1
-                    
-                                       {{15,  1,  8, 14,  6, 11,  3,  4,  9,  7,  2, 13, 12,  0,  5, 10},
-                                        { 3, 13,  4,  7, 15,  2,  8, 14, 12,  0,  1, 10,  6,  9, 11,  5},
-                                        { 0, 14,  7, 11, 10,  4, 13,  1,  5,  8, 12,  6,  9,  3,  2, 15},
-                                        {13,  8, 10,  1,  3, 15,  4,  2, 11,  6,  7, 12,  0,  5, 14,  9}},  // end s-box 2
-
-                                       {{10,  0,  9, 14,  6,  3, 15,  5,  1, 13, 12,  7, 11,  4,  2,  8},
-                                        {13,  7,  0,  9,  3,  4,  6, 10,  2,  8,  5, 14, 12, 11, 15,  1},
-                                        {13,  6,  4,  9,  8, 15,  3,  0, 11,  1,  2, 12,  5, 10, 14,  7},
-                                        { 1, 10, 13,  0,  6,  9,  8,  7,  4, 15, 14,  3, 11,  5,  2, 12}},  // end s-box 3
-
-                                       {{ 7, 13, 14,  3,  0,  6,  9, 10,  1,  2,  8,  5, 11, 12,  4, 15},
-                                        {13,  8, 11,  5,  6, 15,  0,  3,  4,  7,  2, 12,  1, 10, 14,  9},
-                                        {10,  6,  9,  0, 12, 11,  7, 13, 15,  1,  3, 14,  5,  2,  8,  4},
-                                        { 3, 15,  0,  6, 10,  1, 13,  8,  9,  4,  5, 11, 12,  7,  2, 14}},  // end s-box 4
-
-                                       {{ 2, 12,  4,  1,  7, 10, 11,  6,  8,  5,  3, 15, 13,  0, 14,  9},
-                                        {14, 11,  2, 12,  4,  7, 13,  1,  5,  0, 15, 10,  3,  9,  8,  6},
-                                        { 4,  2,  1, 11, 10, 13,  7,  8, 15,  9, 12,  5,  6,  3,  0, 14},
-                                        {11,  8, 12,  7,  1, 14,  2, 13,  6, 15,  0,  9, 10,  4,  5,  3}},  // end s-box 5  
-
-                                       {{12,  1, 10, 15,  9,  2,  6,  8,  0, 13,  3,  4, 14,  7,  5, 11},
-                                        {10, 15,  4,  2,  7, 12,  9,  5,  6,  1, 13, 14,  0, 11,  3,  8},
-                                        { 9, 14, 15,  5,  2,  8, 12,  3,  7,  0,  4, 10,  1, 13, 11,  6},
-                                        { 4,  3,  2, 12,  9,  5, 15, 10, 11, 14,  1,  7,  6,  0,  8, 13}},  // end s-box 6
-
-                                       {{ 4, 11,  2, 14, 15,  0,  8, 13,  3, 12,  9,  7,  5, 10,  6,  1},
-                                        {13,  0, 11,  7,  4,  9,  1, 10, 14,  3,  5, 12,  2, 15,  8,  6},
-                                        { 1,  4, 11, 13, 12,  3,  7, 14, 10, 15,  6,  8,  0,  5,  9,  2},
-                                        { 6, 11, 13,  8,  1,  4, 10,  7,  9,  5,  0, 15, 14,  2,  3, 12}},  // end s-box 7
-
-                                       {{13,  2,  8,  4,  6, 15, 11,  1, 10,  9,  3, 14,  5,  0, 12,  7},
-                                        { 1, 15, 13,  8, 10,  3,  7,  4, 12,  5,  6, 11,  0, 14,  9,  2},
-                                        { 7, 11,  4,  1,  9, 12, 14,  2,  0,  6, 10, 13, 15,  3,  5,  8},
-                                        { 2,  1, 14,  7,  4, 10,  8, 13, 15, 12,  9,  0,  3,  5,  6, 11}}}; // end s-sbox 8
-     
-//==========================================================================================================================
-//end s-table declaration
+struct DesMetrics
+{
+     atomic<uint64_t> bytesProcessed{0};
+     atomic<uint64_t> blocksProcessed{0};
+     atomic<uint64_t> ioNanos{0};
+     atomic<uint64_t> cipherNanos{0};
+     atomic<uint64_t> keyScheduleHits{0};
+     atomic<uint64_t> keyScheduleMisses{0};
+     atomic<uint64_t> bytesBeforeCompression{0};
+     atomic<uint64_t> bytesAfterCompression{0};
+
+     mutex threadLock; // guards threads
+     vector<unique_ptr<DesThreadMetrics>> threads;
+};
+
+DesMetrics metrics;
+
+//===============================================================================
+
+// Returns the calling thread's counters, registering them the first time
+// a thread does cipher work.
+
+DesThreadMetrics& threadMetrics()
+{
+     thread_local DesThreadMetrics* slot = nullptr;
+
+     if(slot == nullptr)
+     {
+          lock_guard<mutex> lock(metrics.threadLock);
+          metrics.threads.push_back(make_unique<DesThreadMetrics>());
+          slot = metrics.threads.back().get();
+          slot->threadNo = metrics.threads.size() - 1;
+     }
+
+     return *slot;
+}
+
+//===============================================================================
+
+inline uint64_t nanosSince(chrono::steady_clock::time_point start)
+{
+     return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count();
+}
+
+//===============================================================================
+
+class MetricsReporter
+{
+public:
+     MetricsReporter(string fileName, int intervalSeconds)
+          : fileName(fileName), stopping(false)
+     {
+          if(intervalSeconds > 0)
+               reporter = thread([this, intervalSeconds] { run(intervalSeconds); });
+     }
 
+     ~MetricsReporter() // stop the interval writer and leave the final numbers behind
+     {
+          {
+               lock_guard<mutex> lock(stopLock);
+               stopping = true;
+          }
+          stopRequested.notify_one();
+
+          if(reporter.joinable())
+               reporter.join();
+
+          writeMetricsFile(fileName);
+     }
+
+     MetricsReporter(const MetricsReporter&) = delete;
+     MetricsReporter& operator=(const MetricsReporter&) = delete;
+
+private:
+     void run(int intervalSeconds)
+     {
+          unique_lock<mutex> lock(stopLock);
+
+          while(!stopRequested.wait_for(lock, chrono::seconds(intervalSeconds), [this] { return stopping; }))
+               writeMetricsFile(fileName);
+     }
+
+     string fileName;
+     mutex stopLock;
+     condition_variable stopRequested;
+     bool stopping;
+     thread reporter;
+};
+
+//===============================================================================
+
+BufferPool bufferPool; // the pool itself is declared in des.h
+
+//===============================================================================
+// Compression
+//
+// With --compress the input is run through an LZ4-style codec before padding
+// and encryption, and a small header is written in the clear ahead of the
+// ciphertext so decryption knows to undo it:
+//
+//      "DESZ" | codec (1 byte) | 3 zero bytes | compressed length (8 bytes, big endian)
+//             | original length (8 bytes, big endian)
+//
+// The compressed stream is a run of frames, one per 64 KB of input, each a
+// 4-byte big endian size followed by an LZ4 block. A set high bit in the size
+// marks a frame that didn't shrink and is stored as-is.
+
+const char compressionMagic[4] = {'D', 'E', 'S', 'Z'};
+const size_t compressionHeaderLength = 24;
+const size_t compressionFrameSize = 64 * 1024;
+
+const int codecNone = 0;
+const int codecLz4 = 1;
+
+struct CompressionHeader
+{
+     int codec = codecNone;
+     uint64_t compressedLength = 0;
+     uint64_t originalLength = 0;
+};
+
+//===============================================================================
+// Table layouts and autotuning
+//
+// The S-box and P-box steps of each round can run three ways:
+//
+//      layoutBitwise - sBoxPermutation then pBoxPermutation, bit by bit
+//      layoutSp8     - eight 64-entry tables (2 KB), S-box output already P-permuted
+//      layoutSp4     - four 4096-entry tables (64 KB), two S-boxes per lookup
+//
+// All three give the same result; which is fastest depends on the host's
+// caches. "des --tune" times each layout on this machine and saves the winner
+// to a profile (~/.des_profile unless a path is given) that later runs load,
+// or that --profile points at.
+
+const int layoutBitwise = 0;
+const int layoutSp8 = 1;
+const int layoutSp4 = 2;
+
+const char* const layoutNames[3] = {"bitwise", "sp8", "sp4"};
+
+atomic<int> tableLayout{layoutBitwise};
+
+uint32_t sp8Tables[8][64];
+uint32_t sp4Tables[4][4096];
+
+//===============================================================================
+
+#ifndef DES_LIBRARY // des.h users bring their own main()
+
+int main(int argc, char** argv)
+{
      int mode; // used for signifying en/decryption
      int padding; // used to make the input string an even multiple of 8
      int numRounds; // number of blocks will be needed to transform
 
+     const int chunkBlocks = 8192; // blocks per engine call, so interval metrics see progress
+
+     bool echo = false; // print the input and output text (slow on big files)
+     bool hugePages = false; // back pooled buffers with 2 MB pages
+     bool compress = false; // compress before encrypting
+     string metricsFile = "";
+     string profileFile = defaultProfilePath();
+     int metricsInterval = 0; // seconds, 0 = only write metrics at exit
+
 // Command line handling ============================================================================
 
-     if (argc != 5)
+     if (argc >= 2 && strcmp(argv[1], "--tune") == 0)
+          return tuneEngine(argc >= 3 ? argv[2] : defaultProfilePath());
+
+     // -s runs as a service, so every way it can fail exits 1 where a supervisor
+     // sees it. -e and -d keep returning 0, the way they always have.
+     int failure = (argc >= 2 && strcmp(argv[1], "-s") == 0) ? 1 : 0;
+
+     if (argc < 5)
      {
           cout << "Invalid command line arguments." << endl;
-          cout << "Please use the form: des [-d|-e] [key] [input file] [output file]" << endl;
-          return 0; 
+          printUsage();
+          return failure;
      }
 
      if (strlen(argv[2]) != 8)
      {
-          cout << "Invalid key length. The key must be an 8-character string" << endl;
-          return 0;
+          cout << invalidKeyMessage << endl;
+          return failure;
      }
 
      if (strcmp(argv[1], "-e") == 0)
@@ -112,85 +352,335 @@ int main(int argc, char** argv)
      else if (strcmp(argv[1], "-d") == 0)
           mode = 1; // decryption mode
 
+     else if (strcmp(argv[1], "-s") == 0)
+          mode = 2; // serve a shared-memory ring, argv[3] is its name and argv[4] its slot count
+
      else
      {
           cout << "Invalid encryption/decryption flag." << endl;
-          cout << "Please use the form: des [-d|-e] [key] [input file] [output file]" << endl;
+          printUsage();
+          return 0;
+     }
+
+     for (int i = 5; i < argc; i++)
+     {
+          if (strcmp(argv[i], "--echo") == 0)
+               echo = true;
+
+          else if (strcmp(argv[i], "--compress") == 0)
+               compress = true;
+
+          else if (strcmp(argv[i], "--hugepages") == 0)
+               hugePages = true;
+
+          else if (strcmp(argv[i], "--metrics") == 0 && i + 1 < argc)
+               metricsFile = argv[++i];
+
+          else if (strcmp(argv[i], "--metrics-interval") == 0 && i + 1 < argc)
+               metricsInterval = atoi(argv[++i]);
+
+          else if (strcmp(argv[i], "--profile") == 0 && i + 1 < argc)
+               profileFile = argv[++i];
+
+          else
+          {
+               cout << "Invalid option: " << argv[i] << endl;
+               printUsage();
+               return failure;
+          }
+     }
+
+     if (mode == 2 && (echo || compress || hugePages)) // ring requests never touch files or the pool
+     {
+          cout << "--echo, --compress and --hugepages only apply to files, not to -s." << endl;
+          printUsage();
+          return failure;
+     }
+
+     if (mode == 1 && compress) // decryption reads the codec from the header
+     {
+          cout << "--compress only applies to -e. Decryption detects compressed files on its own." << endl;
+          printUsage();
           return 0;
      }
 
 // End command line handling ========================================================================
 
-     string text = getFileText(argv[3]);
+     loadTuneProfile(profileFile); // no profile yet just means the defaults
+
+     unique_ptr<MetricsReporter> reporter; // writes the metrics file again when main returns
+
+     if (metricsFile != "")
+          reporter = make_unique<MetricsReporter>(metricsFile, metricsInterval);
+
+     if (mode == 2)
+          return serveShmRing(argv[2], argv[3], atoi(argv[4]));
+
+     bufferPool.useHugePages(hugePages);
+
+     PooledBuffer text = getFileText(argv[3], 8); // leave room for the padding
 
      string key = argv[2];
 
-     string tempText, tempKey, compressedKey, expandedData, 
-            sBoxData, finalPermutedData, changedText; // placeholders for blocks
+     string subKeys[16]; // the 16 compressed round keys, built once for every block
+
+     if (echo)
+     {
+          cout << "Input Text:\n";
+          cout.write(text.data(), text.size()) << endl;
+     }
+
+     //cout << text.size() << endl;
+
+     CompressionHeader header;
+     size_t headerLength = 0; // bytes ahead of the ciphertext that stay in the clear
 
-     cout << "Input Text:\n" << text << endl;
+     if (mode == 0 && compress)
+     {
+          PooledBuffer packed = bufferPool.borrow(compressionHeaderLength + compressBound(text.size()) + 8);
+
+          size_t packedLength = compressText(text.data(), text.size(), packed.data() + compressionHeaderLength);
 
-     //cout << text.length() << endl;
+          writeCompressionHeader(packed.data(), codecLz4, packedLength, text.size());
+          packed.resize(compressionHeaderLength + packedLength);
+
+          text = std::move(packed);
+          headerLength = compressionHeaderLength;
+     }
+     else if (mode == 1 && readCompressionHeader(text.data(), text.size(), header))
+          headerLength = compressionHeaderLength;
 
-     if(text.length() % 8 != 0)
-          padding = 8 - (text.length() % 8); // the amount of chars needed to be
+     if((text.size() - headerLength) % 8 != 0)
+          padding = 8 - ((text.size() - headerLength) % 8); // the amount of chars needed to be
                                                    // divisible by 8.
      else
           padding = 0; // the above formula will add 8 0's if its divisible by 8, not needed
 
 
-     for (int i = 0; i < padding; i++)
-          text += "0"; // pad the string to make it an even multiple of 8
-     
-     changedText = getZeroString(text.length()); // placeholder for permuted text
-     
-     numRounds = text.length() / 8;
+     memset(text.data() + text.size(), '0', padding); // pad the text to make it an even multiple of 8
+     text.resize(text.size() + padding);
+
+     numRounds = (text.size() - headerLength) / 8;
+
+     //cout << text.size() << endl;
 
-     //cout << text.length() << endl;
+     getKeySchedule(key, mode, subKeys);
 
-     for (int i = 0; i < numRounds; i++) // start the transformation
+     for (int i = 0; i < numRounds; i += chunkBlocks) // transform every block in place
+          transformBlocks(text.data() + headerLength + (size_t) i * 8, min(chunkBlocks, numRounds - i), subKeys);
+
+     wipeKeySchedule(subKeys); // done with the key, don't leave it lying around
+     clearKeyScheduleCache();
+
+     if (mode == 1 && header.codec != codecNone)
      {
-          tempText = text.substr(i * 8, 8); // get a 64-bit block into temp
- 
-          //cout << tempText << endl;            
+          PooledBuffer plain;
 
-          //cout << "Binary representation of input: ";  outputBits(tempText, tempText.size() * 8);
-          finalPermutedData = initialPermutation(tempText);
+          if (!decompressText(text.data() + headerLength, header.compressedLength, plain, header.originalLength))
+          {
+               cout << "The decrypted data is not valid compressed data. Is the key right?" << endl;
+               return 0;
+          }
 
+          text = std::move(plain);
+     }
 
-          tempKey = keyPermutation(key);
+     //cout << text.size() << endl;
 
-          //cout << "Initial Key: "; outputKey(tempKey);
-          
-          for(int j = 0; j < 16; j++) // do the 16 rounds
-          {   
-               if(mode == 0)//{
-                    tempKey = shiftKey(tempKey, j, mode); // pass the 56-bit key to split and shift and
-                                                          // pass the round number for the # of shifts
+     if (echo)
+     {
+          cout << "Output Text:\n";
+          cout.write(text.data(), text.size()) << endl;
+     }
+
+     //cout << "Binary representation of output: ";  outputBits(string(text.data(), text.size()), text.size() * 8);
+
+     writeToFile(argv[4], text.data(), text.size());
+}
+
+#endif // DES_LIBRARY
+
+//===============================================================================
+
+void printUsage()
+{
+     cout << "Please use the form: des [-d|-e] [key] [input file] [output file] [options]" << endl;
+     cout << "                 or: des -s [key] [ring name] [slot count] [options]" << endl;
+     cout << "                 or: des --tune [profile file]" << endl;
+     cout << "Options:" << endl;
+     cout << "  --echo                       print the input and output text" << endl;
+     cout << "  --compress                   compress before encrypting (decryption detects it)" << endl;
+     cout << "  --hugepages                  back I/O buffers with 2 MB huge pages" << endl;
+     cout << "  --metrics [file]             write metrics at exit (JSON if the name ends in .json," << endl;
+     cout << "                               Prometheus text otherwise)" << endl;
+     cout << "  --metrics-interval [seconds] also rewrite the metrics file on this interval" << endl;
+     cout << "  --profile [file]             use this tuning profile instead of ~/.des_profile" << endl;
+}
+
+//===============================================================================
+
+// The check main() makes on the command line, for callers that hand us a key
+// directly. keyPermutation reads all 8 bytes, so anything else can't go on.
+
+void requireValidKey(string key)
+{
+     if(key.length() != 8)
+          throw invalid_argument(invalidKeyMessage);
+}
+
+//===============================================================================
+
+// Builds the 16 compressed 48-bit round keys in the order the rounds use them.
+// Decryption walks the same schedule backwards by shifting right.
 
-                    //cout << "Key #" << j + 1 << ": "; outputKey(tempKey);}
-               else//{
-                    if( j != 0) // don't shift the first round. K16 is always the initial key, which we already
-                                // have the first round. Start shifting after the first round.
-                         tempKey = shiftKey(tempKey,16 - j, mode); // do the shifts in reverse if decrypting
-                    //cout << "Key #" << 16 - j << ": "; outputKey(tempKey);}
-               //outputKey(tempKey);
+void buildKeySchedule(string key, int mode, string subKeys[16])
+{
+     string tempKey = keyPermutation(key);
+
+     //cout << "Initial Key: "; outputKey(tempKey);
+
+     for(int j = 0; j < 16; j++)
+     {
+          if(mode == 0)
+               tempKey = shiftKey(tempKey, j, mode); // pass the 56-bit key to split and shift and
+                                                     // pass the round number for the # of shifts
+          else
+               if( j != 0) // don't shift the first round. K16 is always the initial key, which we already
+                           // have the first round. Start shifting after the first round.
+                    tempKey = shiftKey(tempKey,16 - j, mode); // do the shifts in reverse if decrypting
+
+          //cout << "Key #" << j + 1 << ": "; outputKey(tempKey);
+
+          subKeys[j] = compressionPermutation(tempKey);
+     }
+}
+
+//===============================================================================
+
+// Same as buildKeySchedule, but remembers the schedules it has built so every
+// chunk, file or request using the same key and direction skips the rebuild.
+// The cache holds the keys and their round keys, so callers that are done with
+// their keys should call clearKeyScheduleCache to wipe it.
+
+struct CachedKeySchedule
+{
+     string key;
+     int mode;
+     string subKeys[16];
+};
+
+mutex keyScheduleCacheLock;
+vector<CachedKeySchedule> keyScheduleCache; // a short list, searched front to back
+
+void getKeySchedule(string key, int mode, string subKeys[16])
+{
+     const size_t maxCachedKeys = 64; // a long-running caller cycling through keys shouldn't grow forever
+
+     requireValidKey(key);
+
+     {
+          lock_guard<mutex> lock(keyScheduleCacheLock);
+
+          for(CachedKeySchedule& cached : keyScheduleCache)
+          {
+               if(cached.mode == mode && cached.key == key)
+               {
+                    metrics.keyScheduleHits++;
+
+                    for(int j = 0; j < 16; j++)
+                         subKeys[j] = cached.subKeys[j];
+
+                    explicit_bzero(&key[0], key.size()); // our by-value copy
+                    return;
+               }
+          }
+     }
+
+     metrics.keyScheduleMisses++;
+
+     buildKeySchedule(key, mode, subKeys);
+
+     lock_guard<mutex> lock(keyScheduleCacheLock);
+
+     if(keyScheduleCache.size() < maxCachedKeys)
+     {
+          keyScheduleCache.emplace_back();
+          keyScheduleCache.back().key = key;
+          keyScheduleCache.back().mode = mode;
+
+          for(int j = 0; j < 16; j++)
+               keyScheduleCache.back().subKeys[j] = subKeys[j];
+     }
+
+     explicit_bzero(&key[0], key.size());
+}
+
+//===============================================================================
+
+// Zeroes every cached key and round key and empties the cache. Schedules
+// already copied out by callers are theirs to wipe with wipeKeySchedule.
+
+void clearKeyScheduleCache()
+{
+     lock_guard<mutex> lock(keyScheduleCacheLock);
+
+     for(CachedKeySchedule& cached : keyScheduleCache)
+     {
+          explicit_bzero(&cached.key[0], cached.key.size());
+          wipeKeySchedule(cached.subKeys);
+     }
+
+     keyScheduleCache.clear();
+}
+
+//===============================================================================
+
+void wipeKeySchedule(string subKeys[16])
+{
+     for(int j = 0; j < 16; j++)
+          explicit_bzero(&subKeys[j][0], subKeys[j].size());
+}
+
+//===============================================================================
+
+// Runs numBlocks consecutive 64-bit blocks of data through the 16 rounds,
+// writing each result back over its input block.
+
+void transformBlocks(char* data, size_t numBlocks, const string subKeys[16])
+{
+     string tempText, expandedData, sBoxData, finalPermutedData; // placeholders for blocks
+
+     auto start = chrono::steady_clock::now();
 
-               compressedKey = compressionPermutation(tempKey);
+     int layout = tableLayout.load(memory_order_relaxed);
 
+     for (size_t i = 0; i < numBlocks; i++) // start the transformation
+     {
+          tempText.assign(data + i * 8, 8); // get a 64-bit block into temp
+
+          //cout << "Binary representation of input: ";  outputBits(tempText, tempText.size() * 8);
+          finalPermutedData = initialPermutation(tempText);
+
+          for(int j = 0; j < 16; j++) // do the 16 rounds
+          {
                expandedData = expansionPermutation(finalPermutedData);
 
                //cout << "Expanded Data: "; outputBits(expandedData, 48);
 
-               sBoxData = xorTheKeyAndData(compressedKey, expandedData);
+               sBoxData = xorTheKeyAndData(subKeys[j], expandedData);
 
                //cout << "Data after XOR1: "; outputBits(sBoxData, 48);
 
-               sBoxData = sBoxPermutation(sBoxData, sBoxTables);
+               if(layout == layoutBitwise)
+               {
+                    sBoxData = sBoxPermutation(sBoxData, sBoxTables);
 
-               //cout << "Sbox Data: "; outputBits(sBoxData, 32);
+                    //cout << "Sbox Data: "; outputBits(sBoxData, 32);
 
-               sBoxData = pBoxPermutation(sBoxData);
+                    sBoxData = pBoxPermutation(sBoxData);
+               }
+               else
+                    sBoxData = spBoxPermutation(sBoxData, layout); // both steps in one set of lookups
 
                //cout << "pBox Data: "; outputBits(sBoxData, 32);
 
@@ -199,32 +689,32 @@ int main(int argc, char** argv)
                    // initial permutation with the results from the pbox perm.
 
                //cout << "Data after XOR2: "; outputBits(finalPermutedData, 64);
-               
-               if( j != 15) // don't switch the final round (0 being the first)   
-                    finalPermutedData = switchHalves(finalPermutedData);              
+
+               if( j != 15) // don't switch the final round (0 being the first)
+                    finalPermutedData = switchHalves(finalPermutedData);
 
                //cout << "Data after Switch: "; outputBits(finalPermutedData, 64);
           }
-                  
-         finalPermutedData = finalPermutation(finalPermutedData);
-         //cout << "Data after Final Permutation: "; outputBits(finalPermutedData, 64);
-
-         for(int m = 0; m < 8; m++)
-            changedText.at((i * 8) + m) = finalPermutedData.at(m); // append the block to the 
-                                                                   // the entire 
 
-         //cout << "END BLOCK================================================" << endl;      
-     }
+          finalPermutedData = finalPermutation(finalPermutedData);
+          //cout << "Data after Final Permutation: "; outputBits(finalPermutedData, 64);
 
-     //cout << changedText.length() << endl;
+          memcpy(data + i * 8, finalPermutedData.data(), 8); // put the block back where it came from
 
-     cout << "Output Text:\n" << changedText << endl;
+          //cout << "END BLOCK================================================" << endl;
+     }
 
-     //cout << "Binary representation of output: ";  outputBits(changedText, changedText.size() * 8);
+     uint64_t elapsed = nanosSince(start);
+     DesThreadMetrics& mine = threadMetrics();
 
-     writeToFile(argv[4], changedText);
+     metrics.bytesProcessed += numBlocks * 8;
+     metrics.blocksProcessed += numBlocks;
+     metrics.cipherNanos += elapsed;
+     mine.bytesProcessed += numBlocks * 8;
+     mine.cipherNanos += elapsed;
 }
 
+
 //===============================================================================
 
 string initialPermutation(string block)
@@ -609,15 +1099,7 @@ int getColIndex(int bit1, int bit2, int bit3, int bit4) // 0XXXX0 1-4 from L to
 
 string getZeroString(int length)
 {
-     string temp = "";
-
-     for(int i = 0; i < length; i++)
-     {
-          temp += i;
-          temp.at(i) = 0;
-     }
-
-     return temp;
+     return string(length, 0); // blocks are at most 8 chars, so this stays in the small-string buffer
 }
 
 //===============================================================================
@@ -732,10 +1214,12 @@ void putBit(int bitPosition, int bitValue, string& block)
 
 //===============================================================================
 
-void writeToFile(string outputFileName, string text)
+void writeToFile(string outputFileName, const char* text, size_t length)
 {
+     auto start = chrono::steady_clock::now();
+
      ofstream outputFile;
-     outputFile.open(outputFileName.c_str());
+     outputFile.open(outputFileName.c_str(), ios::binary);
 
      if(!outputFile)
      {
@@ -743,10 +1227,12 @@ void writeToFile(string outputFileName, string text)
           //system.exit(0); // quit
      }
 
-     outputFile << text; // write to file
+     outputFile.write(text, length); // write to file
 
      outputFile.close();
 
+     metrics.ioNanos += nanosSince(start);
+
      cout << "File write to " << outputFileName << " complete." << endl;
 
      return;
@@ -754,25 +1240,995 @@ void writeToFile(string outputFileName, string text)
 
 //===============================================================================
 
-string getFileText(string inputFileName)
+// Reads the whole file into a pooled buffer. spare extra bytes of capacity are
+// left after the text so the caller can pad it in place.
+
+PooledBuffer getFileText(string inputFileName, size_t spare)
 {
-     string input = "";
-     char buffer;
+     auto start = chrono::steady_clock::now();
 
      ifstream inputFile;
-     inputFile.open(inputFileName.c_str());
+     inputFile.open(inputFileName.c_str(), ios::binary);
 
      if(!inputFile)
      {
           cout << "Bad file name. Please try again." << endl;
      }
 
-     while(inputFile.get(buffer))
-          input = input + buffer;
-     
+     size_t length = 0;
+     streamoff fileSize = inputFile.seekg(0, ios::end).tellg(); // a pipe can't tell us, we just grow
+
+     inputFile.clear();
+     inputFile.seekg(0, ios::beg);
+     inputFile.clear();
+
+     PooledBuffer input = bufferPool.borrow((fileSize > 0 ? fileSize : 0) + spare);
+
+     if(fileSize > 0) // the size is known, so read exactly that and don't probe for more
+     {
+          inputFile.read(input.data(), fileSize);
+          length = inputFile.gcount();
+     }
+     else // a pipe, or a file that reports no size
+     {
+          for(;;)
+          {
+               if(input.capacity() - length <= spare) // out of room, move to the next size class
+               {
+                    if(inputFile.peek() == EOF) // the data filled the buffer exactly, nothing more to hold
+                         break;
+
+                    PooledBuffer bigger = bufferPool.borrow(input.capacity() * 2);
+                    memcpy(bigger.data(), input.data(), length);
+                    input = std::move(bigger);
+               }
+
+               inputFile.read(input.data() + length, input.capacity() - length - spare);
+               length += inputFile.gcount();
+
+               if(!inputFile)
+                    break;
+          }
+     }
+
+     input.resize(length);
+
      inputFile.close();
 
-     return input;         
+     metrics.ioNanos += nanosSince(start);
+
+     return input;
+}
+
+//===============================================================================
+
+// Renders the current counters as Prometheus text exposition format, or as a
+// JSON object when json is true.
+
+string formatMetrics(bool json)
+{
+     struct Counter { const char* name; const char* help; uint64_t value; bool nanos; };
+
+     const double nanosPerSecond = 1e9;
+
+     Counter counters[] = {
+          {"des_bytes_processed_total", "Bytes run through the 16 rounds.", metrics.bytesProcessed.load(), false},
+          {"des_blocks_processed_total", "64-bit blocks run through the 16 rounds.", metrics.blocksProcessed.load(), false},
+          {"des_io_seconds_total", "Time spent reading the input and writing the output file.", metrics.ioNanos.load(), true},
+          {"des_cipher_seconds_total", "Time spent inside the block engine, summed over threads.", metrics.cipherNanos.load(), true},
+          {"des_key_schedule_cache_hits_total", "Key schedules served from the cache.", metrics.keyScheduleHits.load(), false},
+          {"des_key_schedule_cache_misses_total", "Key schedules that had to be built.", metrics.keyScheduleMisses.load(), false},
+          {"des_compression_input_bytes_total", "Bytes fed to the compressor.", metrics.bytesBeforeCompression.load(), false},
+          {"des_compression_output_bytes_total", "Bytes the compressor produced.", metrics.bytesAfterCompression.load(), false},
+          {"des_buffer_pool_borrows_total", "Buffers handed out by the buffer pool.", bufferPool.borrows.load(), false},
+          {"des_buffer_pool_reuses_total", "Buffers served from the pool's free list.", bufferPool.reuses.load(), false},
+          {"des_buffer_pool_slab_allocations_total", "Slabs the buffer pool had to allocate.", bufferPool.slabAllocations.load(), false},
+          {"des_buffer_pool_huge_page_slabs_total", "Slabs backed by 2 MB huge pages.", bufferPool.hugePageSlabs.load(), false}};
+
+     ostringstream out;
+     out << fixed; // seconds with 6 decimals, never scientific notation
+
+     lock_guard<mutex> lock(metrics.threadLock);
+
+     if(json)
+     {
+          out << "{";
+
+          for(const Counter& counter : counters)
+          {
+               out << "\"" << counter.name << "\": ";
+
+               if(counter.nanos)
+                    out << counter.value / nanosPerSecond << ", ";
+               else
+                    out << counter.value << ", ";
+          }
+
+          out << "\"threads\": [";
+
+          for(size_t i = 0; i < metrics.threads.size(); i++)
+          {
+               DesThreadMetrics& thread = *metrics.threads[i];
+               double seconds = thread.cipherNanos.load() / nanosPerSecond;
+
+               out << (i == 0 ? "" : ", ")
+                   << "{\"thread\": " << thread.threadNo
+                   << ", \"bytes_processed\": " << thread.bytesProcessed.load()
+                   << ", \"throughput_bytes_per_second\": " << (uint64_t)(seconds > 0 ? thread.bytesProcessed.load() / seconds : 0) << "}";
+          }
+
+          out << "]}" << endl;
+     }
+     else
+     {
+          for(const Counter& counter : counters)
+          {
+               out << "# HELP " << counter.name << " " << counter.help << endl;
+               out << "# TYPE " << counter.name << " counter" << endl;
+
+               if(counter.nanos)
+                    out << counter.name << " " << counter.value / nanosPerSecond << endl;
+               else
+                    out << counter.name << " " << counter.value << endl;
+          }
+
+          out << "# HELP des_thread_bytes_processed_total Bytes run through the 16 rounds by one thread." << endl;
+          out << "# TYPE des_thread_bytes_processed_total counter" << endl;
+
+          for(auto& thread : metrics.threads)
+               out << "des_thread_bytes_processed_total{thread=\"" << thread->threadNo << "\"} "
+                   << thread->bytesProcessed.load() << endl;
+
+          out << "# HELP des_thread_throughput_bytes_per_second Bytes per second of cipher time for one thread." << endl;
+          out << "# TYPE des_thread_throughput_bytes_per_second gauge" << endl;
+
+          for(auto& thread : metrics.threads)
+          {
+               double seconds = thread->cipherNanos.load() / nanosPerSecond;
+
+               out << "des_thread_throughput_bytes_per_second{thread=\"" << thread->threadNo << "\"} "
+                   << (uint64_t)(seconds > 0 ? thread->bytesProcessed.load() / seconds : 0) << endl;
+          }
+     }
+
+     return out.str();
+}
+
+//===============================================================================
+
+// Writes a metrics snapshot next to the target and renames it into place, so a
+// scraper never reads a half-written file.
+
+void writeMetricsFile(string metricsFileName)
+{
+     bool json = metricsFileName.size() >= 5 &&
+                 metricsFileName.compare(metricsFileName.size() - 5, 5, ".json") == 0;
+
+     string tempFileName = metricsFileName + ".tmp";
+
+     ofstream metricsFile(tempFileName.c_str());
+
+     if(!metricsFile)
+     {
+          cout << "Could not write metrics to " << metricsFileName << endl;
+          return;
+     }
+
+     metricsFile << formatMetrics(json);
+     metricsFile.close();
+
+     rename(tempFileName.c_str(), metricsFileName.c_str());
+}
+
+//===============================================================================
+
+// Worst case size of compressText's output for length bytes of input.
+
+size_t compressBound(size_t length)
+{
+     size_t frames = (length + compressionFrameSize - 1) / compressionFrameSize;
+
+     return length + frames * 4; // a frame that doesn't shrink is stored raw behind its size
+}
+
+//===============================================================================
+
+// Compresses text into dst, which needs compressBound(length) bytes, one 64 KB
+// frame at a time. Returns the number of bytes written.
+
+size_t compressText(const char* text, size_t length, char* dst)
+{
+     unsigned char scratch[compressionFrameSize + compressionFrameSize / 255 + 16]; // an LZ4 block's worst case
+     size_t written = 0;
+
+     for (size_t start = 0; start < length; start += compressionFrameSize)
+     {
+          size_t frameLength = min(compressionFrameSize, length - start);
+          const unsigned char* frame = (const unsigned char*) text + start;
+
+          size_t packedLength = lz4CompressBlock(frame, frameLength, scratch);
+          uint32_t sizeField;
+
+          if (packedLength < frameLength)
+          {
+               memcpy(dst + written + 4, scratch, packedLength);
+               sizeField = packedLength;
+          }
+          else
+          {
+               memcpy(dst + written + 4, frame, frameLength); // incompressible, store it raw
+               packedLength = frameLength;
+               sizeField = frameLength | 0x80000000u;
+          }
+
+          for (int b = 0; b < 4; b++)
+               dst[written + b] = (char)(sizeField >> (24 - 8 * b));
+
+          written += 4 + packedLength;
+     }
+
+     metrics.bytesBeforeCompression += length;
+     metrics.bytesAfterCompression += written;
+
+     return written;
+}
+
+//===============================================================================
+
+// Undoes compressText into text, which it borrows. Returns false if the frames
+// don't decode to exactly originalLength bytes, which is what a wrong key looks
+// like. originalLength comes from the clear-text header, so it is never
+// borrowed up front: text grows only as frames check out, and an LZ4 frame can
+// claim at most 255 output bytes per payload byte, so a forged header can't
+// make the pool hand out much more than the input could really decode to.
+
+bool decompressText(const char* src, size_t length, PooledBuffer& text, size_t originalLength)
+{
+     size_t read = 0;
+     size_t produced = 0;
+
+     text = bufferPool.borrow(min(originalLength, compressionFrameSize));
+
+     while (read < length)
+     {
+          if (length - read < 4)
+               return false;
+
+          uint32_t sizeField = 0;
+
+          for (int b = 0; b < 4; b++)
+               sizeField = (sizeField << 8) | (unsigned char) src[read + b];
+
+          read += 4;
+
+          bool raw = (sizeField & 0x80000000u) != 0;
+          size_t packedLength = sizeField & 0x7fffffffu;
+          size_t frameLength = min(compressionFrameSize, originalLength - produced);
+
+          if (packedLength > length - read || produced == originalLength)
+               return false;
+
+          if (raw ? packedLength != frameLength : frameLength > packedLength * 255 + 255)
+               return false;
+
+          if (produced + frameLength > text.size()) // double, but never past what the header claims
+          {
+               PooledBuffer bigger = bufferPool.borrow(min(originalLength, max(text.size() * 2, produced + frameLength)));
+               memcpy(bigger.data(), text.data(), produced);
+               text = std::move(bigger);
+          }
+
+          if (raw)
+               memcpy(text.data() + produced, src + read, frameLength);
+
+          else if (!lz4DecompressBlock((const unsigned char*) src + read, packedLength,
+                                       (unsigned char*) text.data() + produced, frameLength))
+               return false;
+
+          read += packedLength;
+          produced += frameLength;
+     }
+
+     return produced == originalLength;
+}
+
+//===============================================================================
+
+// Greedy LZ4 block compressor: a 4096-entry hash of 4-byte sequences finds
+// matches up to 64 KB back. Follows the block format's end rules (the last
+// 5 bytes are always literals and no match starts in the last 12), so the
+// output decodes with any LZ4 block decoder. dst needs length + length / 255
+// + 16 bytes.
+
+size_t lz4CompressBlock(const unsigned char* src, size_t length, unsigned char* dst)
+{
+     const int hashBits = 12;
+     const size_t minMatch = 4;
+
+     int table[1 << hashBits];
+     unsigned char* out = dst;
+     size_t anchor = 0; // first literal not yet written
+     size_t pos = 0;
+
+     for (int i = 0; i < (1 << hashBits); i++)
+          table[i] = -1;
+
+     auto writeLength = [&out](size_t extra) // the 255, 255, ..., remainder tail of a long length
+     {
+          for (; extra >= 255; extra -= 255)
+               *out++ = 255;
+          *out++ = (unsigned char) extra;
+     };
+
+     if (length > 12)
+     {
+          size_t matchLimit = length - 5;
+          size_t searchLimit = length - 12;
+
+          while (pos < searchLimit)
+          {
+               uint32_t sequence;
+               memcpy(&sequence, src + pos, 4);
+
+               uint32_t hash = (sequence * 2654435761u) >> (32 - hashBits);
+               int candidate = table[hash];
+               table[hash] = pos;
+
+               if (candidate < 0 || pos - candidate > 65535 || memcmp(src + candidate, src + pos, 4) != 0)
+               {
+                    pos++;
+                    continue;
+               }
+
+               size_t matchLength = minMatch;
+
+               while (pos + matchLength < matchLimit && src[candidate + matchLength] == src[pos + matchLength])
+                    matchLength++;
+
+               size_t literalLength = pos - anchor;
+               size_t offset = pos - candidate;
+
+               *out++ = (unsigned char)((min(literalLength, (size_t) 15) << 4) | min(matchLength - minMatch, (size_t) 15));
+
+               if (literalLength >= 15)
+                    writeLength(literalLength - 15);
+
+               memcpy(out, src + anchor, literalLength);
+               out += literalLength;
+
+               *out++ = (unsigned char)(offset & 0xff); // offsets are little endian
+               *out++ = (unsigned char)(offset >> 8);
+
+               if (matchLength - minMatch >= 15)
+                    writeLength(matchLength - minMatch - 15);
+
+               pos += matchLength;
+               anchor = pos;
+          }
+     }
+
+     size_t literalLength = length - anchor; // the last sequence is literals only
+
+     *out++ = (unsigned char)(min(literalLength, (size_t) 15) << 4);
+
+     if (literalLength >= 15)
+          writeLength(literalLength - 15);
+
+     memcpy(out, src + anchor, literalLength);
+     out += literalLength;
+
+     return out - dst;
+}
+
+//===============================================================================
+
+// Decodes one LZ4 block that must expand to exactly length bytes. Every read
+// and copy is bounds checked, since a wrong key hands us random bytes.
+
+bool lz4DecompressBlock(const unsigned char* src, size_t srcLength, unsigned char* dst, size_t length)
+{
+     size_t in = 0;
+     size_t out = 0;
+
+     auto readLength = [&](size_t& value) // adds the 255-run tail of a long length
+     {
+          unsigned char next;
+
+          do
+          {
+               if (in >= srcLength)
+                    return false;
+
+               next = src[in++];
+               value += next;
+          } while (next == 255);
+
+          return true;
+     };
+
+     for (;;)
+     {
+          if (in >= srcLength)
+               return false;
+
+          unsigned char token = src[in++];
+          size_t literalLength = token >> 4;
+
+          if (literalLength == 15 && !readLength(literalLength))
+               return false;
+
+          if (literalLength > srcLength - in || literalLength > length - out)
+               return false;
+
+          memcpy(dst + out, src + in, literalLength);
+          in += literalLength;
+          out += literalLength;
+
+          if (in == srcLength) // last sequence has no match
+               return out == length;
+
+          if (srcLength - in < 2)
+               return false;
+
+          size_t offset = src[in] | (src[in + 1] << 8);
+          in += 2;
+
+          size_t matchLength = token & 15;
+
+          if (matchLength == 15 && !readLength(matchLength))
+               return false;
+
+          matchLength += 4;
+
+          if (offset == 0 || offset > out || matchLength > length - out)
+               return false;
+
+          for (size_t i = 0; i < matchLength; i++, out++) // byte at a time, matches may overlap themselves
+               dst[out] = dst[out - offset];
+     }
+}
+
+//===============================================================================
+
+void writeCompressionHeader(char* header, int codec, uint64_t compressedLength, uint64_t originalLength)
+{
+     memcpy(header, compressionMagic, 4);
+
+     header[4] = (char) codec;
+     header[5] = header[6] = header[7] = 0;
+
+     for (int b = 0; b < 8; b++)
+     {
+          header[8 + b] = (char)(compressedLength >> (56 - 8 * b));
+          header[16 + b] = (char)(originalLength >> (56 - 8 * b));
+     }
+}
+
+//===============================================================================
+
+// Recognizes a compressed file by its header. Besides the magic, the lengths
+// have to account for the file size exactly, so ordinary ciphertext that
+// happens to start with "DESZ" isn't mistaken for one.
+
+bool readCompressionHeader(const char* text, size_t length, CompressionHeader& header)
+{
+     if (length < compressionHeaderLength || memcmp(text, compressionMagic, 4) != 0)
+          return false;
+
+     if (text[4] != codecLz4 || text[5] != 0 || text[6] != 0 || text[7] != 0)
+          return false;
+
+     uint64_t compressedLength = 0, originalLength = 0;
+
+     for (int b = 0; b < 8; b++)
+     {
+          compressedLength = (compressedLength << 8) | (unsigned char) text[8 + b];
+          originalLength = (originalLength << 8) | (unsigned char) text[16 + b];
+     }
+
+     if (compressedLength > length || compressionHeaderLength + (compressedLength + 7) / 8 * 8 != length)
+          return false;
+
+     if (compressedLength > compressBound(originalLength) || originalLength > compressedLength * 255 + 255)
+          return false;
+
+     header.codec = text[4];
+     header.compressedLength = compressedLength;
+     header.originalLength = originalLength;
+
+     return true;
+}
+
+//===============================================================================
+
+volatile sig_atomic_t shmRingStopRequested = 0;
+
+void requestShmRingStop(int)
+{
+     shmRingStopRequested = 1;
+}
+
+//===============================================================================
+
+// Creates the ring and transforms requests in submission order until a signal
+// asks us to stop. Returns main()'s exit code: 0 after a clean shutdown, 1 if
+// the ring could not be set up.
+
+int serveShmRing(string key, string ringName, int slotCount)
+{
+     if (slotCount <= 0)
+     {
+          cout << "Invalid slot count. It must be a positive number." << endl;
+          return 1;
+     }
+
+     size_t slotStride = sizeof(ShmRingSlot) + shmSlotSize;
+     size_t mappedLength = sizeof(ShmRingHeader) + slotStride * slotCount;
+
+     int fd = shm_open(ringName.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+
+     if (fd < 0 || ftruncate(fd, mappedLength) != 0)
+     {
+          cout << "Could not create shared memory ring " << ringName << ": " << strerror(errno) << endl;
+          if (fd >= 0)
+          {
+               close(fd);
+               shm_unlink(ringName.c_str());
+          }
+          return 1;
+     }
+
+     void* memory = mmap(nullptr, mappedLength, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+     close(fd);
+
+     if (memory == MAP_FAILED)
+     {
+          cout << "Could not map shared memory ring " << ringName << ": " << strerror(errno) << endl;
+          shm_unlink(ringName.c_str());
+          return 1;
+     }
+
+     ShmRing ring;
+     ring.header = (ShmRingHeader*) memory; // ftruncate zero-filled it, so head, tail and every slot state start at 0
+     ring.mappedLength = mappedLength;
+     ring.header->slotCount = slotCount;
+     ring.header->slotSize = shmSlotSize;
+     ring.header->magic.store(shmRingMagic, memory_order_release);
+
+     struct sigaction stop = {};
+     stop.sa_handler = requestShmRingStop; // no SA_RESTART, so a sleeping futex wakes up with EINTR
+     sigaction(SIGINT, &stop, nullptr);
+     sigaction(SIGTERM, &stop, nullptr);
+
+     string subKeys[2][16]; // both directions, picked per request
+
+     getKeySchedule(key, 0, subKeys[0]);
+     getKeySchedule(key, 1, subKeys[1]);
+
+     cout << "Serving " << slotCount << " slots on shared memory ring " << ringName << endl;
+
+     uint32_t tail = 0;
+     const timespec stopCheckInterval = {1, 0}; // covers a signal landing just before we go to sleep
+
+     while (!shmRingStopRequested)
+     {
+          uint32_t head = ring.header->head.load(memory_order_acquire);
+
+          if (head == tail)
+          {
+               futexWait(ring.header->head, head, &stopCheckInterval); // nothing queued, sleep until the client bumps head
+               continue;
+          }
+
+          ShmRingSlot* slot = shmRingSlot(ring, tail);
+          char* data = (char*)(slot + 1);
+
+          if (slot->state.load(memory_order_acquire) == slotRequest)
+          {
+               uint32_t length = min(slot->length, shmSlotSize);
+               uint32_t padding = (8 - length % 8) % 8;
+
+               memset(data + length, '0', padding); // pad the same way files are padded
+               length += padding;
+
+               transformBlocks(data, length / 8, subKeys[slot->mode == 1 ? 1 : 0]);
+
+               slot->length = length;
+               slot->state.store(slotDone, memory_order_release);
+               futexWake(slot->state);
+          }
+
+          tail++;
+          ring.header->tail.store(tail, memory_order_release);
+     }
+
+     cout << "Shutting down shared memory ring " << ringName << endl;
+
+     // Close before failing the slots: a client that submits after we looked at
+     // its slot sees closed when it waits, one that submitted before gets woken.
+     ring.header->closed.store(1);
+
+     for (int i = 0; i < slotCount; i++)
+     {
+          ShmRingSlot* slot = shmRingSlot(ring, i);
+          uint32_t pending = slotRequest;
+
+          if (slot->state.compare_exchange_strong(pending, slotFailed))
+               futexWake(slot->state);
+     }
+
+     munmap(memory, mappedLength);
+     shm_unlink(ringName.c_str());
+
+     wipeKeySchedule(subKeys[0]);
+     wipeKeySchedule(subKeys[1]);
+     clearKeyScheduleCache();
+
+     return 0;
+}
+
+//===============================================================================
+
+// Maps a ring that a "des -s" worker has already created.
+
+bool shmRingAttach(string ringName, ShmRing& ring)
+{
+     int fd = shm_open(ringName.c_str(), O_RDWR, 0);
+
+     if (fd < 0)
+          return false;
+
+     struct stat info;
+
+     if (fstat(fd, &info) != 0 || (size_t) info.st_size < sizeof(ShmRingHeader))
+     {
+          close(fd);
+          return false;
+     }
+
+     void* memory = mmap(nullptr, info.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+     close(fd);
+
+     if (memory == MAP_FAILED)
+          return false;
+
+     ring.header = (ShmRingHeader*) memory;
+     ring.mappedLength = info.st_size;
+
+     if (ring.header->magic.load(memory_order_acquire) != shmRingMagic)
+     {
+          shmRingDetach(ring);
+          return false;
+     }
+
+     return true;
+}
+
+//===============================================================================
+
+void shmRingDetach(ShmRing& ring)
+{
+     if (ring.header != nullptr)
+          munmap(ring.header, ring.mappedLength);
+
+     ring.header = nullptr;
+     ring.mappedLength = 0;
+}
+
+//===============================================================================
+
+// The slot a running sequence number lands on; its payload follows it directly.
+
+ShmRingSlot* shmRingSlot(ShmRing& ring, uint32_t sequence)
+{
+     size_t slotStride = sizeof(ShmRingSlot) + ring.header->slotSize;
+     char* slots = (char*) ring.header + sizeof(ShmRingHeader);
+
+     return (ShmRingSlot*)(slots + (sequence % ring.header->slotCount) * slotStride);
+}
+
+//===============================================================================
+
+// Returns the payload of the next slot to fill (slotSize bytes, leave room to
+// pad to a multiple of 8), or nullptr if the ring is full or closed. sequence identifies
+// the slot in the calls that follow.
+
+char* shmRingAcquire(ShmRing& ring, uint32_t& sequence)
+{
+     if (ring.header->closed.load(memory_order_acquire))
+          return nullptr;
+
+     sequence = ring.header->head.load(memory_order_relaxed); // we are the only writer of head
+
+     ShmRingSlot* slot = shmRingSlot(ring, sequence);
+
+     if (slot->state.load(memory_order_acquire) != slotFree)
+          return nullptr;
+
+     return (char*)(slot + 1);
+}
+
+//===============================================================================
+
+void shmRingSubmit(ShmRing& ring, uint32_t sequence, int mode, uint32_t length)
+{
+     ShmRingSlot* slot = shmRingSlot(ring, sequence);
+
+     slot->mode = mode;
+     slot->length = length;
+     slot->state.store(slotRequest); // seq_cst, ordered against the closed check in shmRingWait
+
+     ring.header->head.store(sequence + 1, memory_order_release);
+     futexWake(ring.header->head);
+}
+
+//===============================================================================
+
+// Blocks until the worker is done with the slot and sets length to the length
+// of the transformed payload. Returns false, with the slot left untransformed,
+// if the worker shut down first or timeout (nullptr = wait forever) ran out.
+// Either way the slot still has to be released.
+
+bool shmRingWait(ShmRing& ring, uint32_t sequence, uint32_t& length, const timespec* timeout)
+{
+     ShmRingSlot* slot = shmRingSlot(ring, sequence);
+
+     auto deadline = chrono::steady_clock::now();
+
+     if (timeout != nullptr)
+          deadline += chrono::seconds(timeout->tv_sec) + chrono::nanoseconds(timeout->tv_nsec);
+
+     for (;;)
+     {
+          uint32_t state = slot->state.load(memory_order_acquire);
+
+          if (state == slotDone)
+          {
+               length = slot->length;
+               return true;
+          }
+
+          if (state == slotFailed || ring.header->closed.load())
+               return false;
+
+          if (timeout == nullptr)
+          {
+               futexWait(slot->state, state);
+               continue;
+          }
+
+          auto left = chrono::duration_cast<chrono::nanoseconds>(deadline - chrono::steady_clock::now()).count();
+
+          if (left <= 0)
+               return false;
+
+          timespec remaining = {(time_t)(left / 1000000000), (long)(left % 1000000000)};
+          futexWait(slot->state, state, &remaining);
+     }
+}
+
+//===============================================================================
+
+void shmRingRelease(ShmRing& ring, uint32_t sequence)
+{
+     shmRingSlot(ring, sequence)->state.store(slotFree, memory_order_release);
+}
+
+//===============================================================================
+
+// Shared (not FUTEX_PRIVATE) futex calls, since the word lives in a mapping
+// other processes have too. futexWait returns right away if the word no longer
+// holds expected, and may also return early (signal, timeout); callers re-check
+// and loop.
+
+void futexWait(atomic<uint32_t>& word, uint32_t expected, const timespec* timeout)
+{
+     syscall(SYS_futex, (uint32_t*) &word, FUTEX_WAIT, expected, timeout, nullptr, 0);
+}
+
+void futexWake(atomic<uint32_t>& word)
+{
+     syscall(SYS_futex, (uint32_t*) &word, FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+}
+
+//===============================================================================
+
+// Fills sp8Tables and sp4Tables from sBoxTables, pushing every S-box output
+// through pBoxPermutation (and so straightPermutationTable). P only moves bits
+// around, so the permuted outputs of the eight S-boxes can simply be OR'd.
+
+void buildSpTables()
+{
+     static once_flag built;
+
+     call_once(built, []
+     {
+          for(int box = 0; box < 8; box++)
+          {
+               for(int value = 0; value < 64; value++) // the 6 input bits, first bit on the left
+               {
+                    int row = ((value >> 4) & 2) | (value & 1);
+                    int col = (value >> 1) & 15;
+
+                    string sBoxOut = getZeroString(4);
+                    sBoxOut.at(box / 2) = sBoxTables[box][row][col] << (box % 2 == 0 ? 4 : 0);
+
+                    string permuted = pBoxPermutation(sBoxOut);
+                    uint32_t entry = 0;
+
+                    for(int i = 0; i < 4; i++)
+                         entry = (entry << 8) | (unsigned char) permuted.at(i);
+
+                    sp8Tables[box][value] = entry;
+               }
+          }
+
+          for(int pair = 0; pair < 4; pair++)
+               for(int value = 0; value < 4096; value++)
+                    sp4Tables[pair][value] = sp8Tables[pair * 2][value >> 6] | sp8Tables[pair * 2 + 1][value & 63];
+     });
+}
+
+//===============================================================================
+
+// The table version of sBoxPermutation followed by pBoxPermutation: takes the
+// 48-bit XOR result and returns the 32-bit P-box output.
+
+string spBoxPermutation(string data, int layout)
+{
+     uint64_t bits = 0;
+     uint32_t result = 0;
+
+     for(int i = 0; i < 6; i++)
+          bits = (bits << 8) | (unsigned char) data.at(i);
+
+     if(layout == layoutSp8)
+     {
+          for(int box = 0; box < 8; box++)
+               result |= sp8Tables[box][(bits >> (42 - 6 * box)) & 63];
+     }
+     else
+     {
+          for(int pair = 0; pair < 4; pair++)
+               result |= sp4Tables[pair][(bits >> (36 - 12 * pair)) & 4095];
+     }
+
+     string temp = getZeroString(4);
+
+     for(int i = 0; i < 4; i++)
+          temp.at(i) = (char)(result >> (24 - 8 * i));
+
+     return temp;
+}
+
+//===============================================================================
+
+string defaultProfilePath()
+{
+     const char* home = getenv("HOME");
+
+     return home != nullptr ? string(home) + "/.des_profile" : ".des_profile";
+}
+
+//===============================================================================
+
+// Reads a profile written by tuneEngine and switches the engine to its table
+// layout. Returns false, leaving everything at the defaults, if there is no
+// profile or it doesn't make sense.
+
+bool loadTuneProfile(string profileFileName)
+{
+     ifstream profileFile(profileFileName.c_str());
+
+     if(!profileFile)
+          return false;
+
+     int layout = -1;
+     string line;
+
+     while(getline(profileFile, line))
+     {
+          if(line.compare(0, 7, "layout=") == 0)
+          {
+               for(int i = 0; i < 3; i++)
+                    if(line.substr(7) == layoutNames[i])
+                         layout = i;
+          }
+     }
+
+     if(layout < 0)
+          return false;
+
+     if(layout != layoutBitwise)
+          buildSpTables();
+
+     tableLayout.store(layout);
+
+     return true;
+}
+
+//===============================================================================
+
+// Bytes per second the engine manages with the given layout. One untimed
+// batch warms the tables and caches first, then it runs for at least a fifth
+// of a second so short timer hiccups don't pick the winner.
+
+double measureThroughput(int layout)
+{
+     const double minSeconds = 0.2;
+     const int batchBlocks = 512;
+
+     static string subKeys[16];
+     static PooledBuffer data;
+
+     if(data.size() == 0)
+     {
+          getKeySchedule("autotune", 0, subKeys);
+
+          data = bufferPool.borrow(batchBlocks * 8);
+          mt19937 random(42);
+
+          for(size_t i = 0; i < data.size(); i++)
+               data.data()[i] = (char) random();
+     }
+
+     tableLayout.store(layout);
+
+     transformBlocks(data.data(), batchBlocks, subKeys); // warm-up, not timed
+
+     size_t blocks = 0;
+     auto start = chrono::steady_clock::now();
+     double elapsed;
+
+     do
+     {
+          transformBlocks(data.data(), batchBlocks, subKeys);
+          blocks += batchBlocks;
+          elapsed = nanosSince(start) / 1e9;
+     } while(elapsed < minSeconds);
+
+     return blocks * 8 / elapsed;
+}
+
+//===============================================================================
+
+// "des --tune": picks the fastest table layout and writes it to the profile.
+// Returns main()'s exit code.
+
+int tuneEngine(string profileFileName)
+{
+     buildSpTables();
+
+     int bestLayout = layoutBitwise;
+     double bestRate = 0;
+
+     for(int layout = 0; layout < 3; layout++)
+     {
+          double rate = measureThroughput(layout);
+
+          cout << "layout " << layoutNames[layout] << ": " << (uint64_t) rate << " bytes/s" << endl;
+
+          if(rate > bestRate)
+          {
+               bestRate = rate;
+               bestLayout = layout;
+          }
+     }
+
+     ofstream profileFile(profileFileName.c_str());
+
+     if(!profileFile)
+     {
+          cout << "Could not write the profile to " << profileFileName << endl;
+          return 1;
+     }
+
+     profileFile << "# des autotune profile, rerun des --tune after moving to different hardware" << endl;
+     profileFile << "layout=" << layoutNames[bestLayout] << endl;
+
+     cout << "Saved layout " << layoutNames[bestLayout] << " to " << profileFileName << endl;
+
+     return 0;
 }
 
 //===============================================================================
@@ -0,0 +1,716 @@
+// File Name: des.h
+// Program Description: The parts of des.cpp that other programs can use: the block engine, the
+//                      buffer pool, the shared-memory ring client, transformAsync and DesStreamBuf.
+//                      Build des.cpp with -DDES_LIBRARY to leave out the command line tool's main()
+//                      and link it with your own code; examples/ has a program for each of them.
+//
+//                      g++ -std=c++20 -O2 -pthread -DDES_LIBRARY des.cpp examples/ring_client.cpp -o ring_client
+
+#ifndef DES_H
+#define DES_H
+
+#include <string.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <atomic>
+#include <condition_variable>
+#include <coroutine>
+#include <deque>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <new>
+#include <stdexcept>
+#include <streambuf>
+#include <string>
+#include <thread>
+#include <vector>
+
+class PooledBuffer;
+struct ShmRing;
+
+void requireValidKey(std::string);
+void buildKeySchedule(std::string,int,std::string[16]);
+void getKeySchedule(std::string,int,std::string[16]);
+void clearKeyScheduleCache();
+void wipeKeySchedule(std::string[16]);
+void transformBlocks(char*,size_t,const std::string[16]);
+bool shmRingAttach(std::string,ShmRing&);
+void shmRingDetach(ShmRing&);
+char* shmRingAcquire(ShmRing&,uint32_t&);
+void shmRingSubmit(ShmRing&,uint32_t,int,uint32_t);
+bool shmRingWait(ShmRing&,uint32_t,uint32_t&,const timespec* = nullptr);
+void shmRingRelease(ShmRing&,uint32_t);
+
+//===============================================================================
+// Buffer pool
+//
+// Whole-file and chunk buffers are borrowed from bufferPool instead of being
+// grown a char at a time. Slabs are 64-byte aligned, sized in powers of two
+// (at least 4 KB, or 2 MB once huge pages are turned on) and go back on a free
+// list when the PooledBuffer holding them is destroyed, so the next file or
+// chunk of the same size class reuses them. In steady state slabAllocations
+// stops moving while borrows keeps counting up. A slab has its used bytes
+// zeroed on the way back, so the next borrower never sees the last file's
+// plaintext.
+//
+// With huge pages on, slabs are mapped with MAP_HUGETLB; if the host has no
+// huge pages reserved we fall back to a normal mapping advised for
+// transparent huge pages.
+
+struct PoolSlab
+{
+     char* data = nullptr;
+     size_t capacity = 0;
+     bool mapped = false; // came from mmap rather than aligned_alloc
+};
+
+class BufferPool;
+
+class PooledBuffer
+{
+public:
+     PooledBuffer() : pool(nullptr), length(0), used(0) {}
+     PooledBuffer(BufferPool* pool, PoolSlab slab, size_t length) : pool(pool), slab(slab), length(length), used(length) {}
+     ~PooledBuffer();
+
+     PooledBuffer(PooledBuffer&& other) : pool(other.pool), slab(other.slab), length(other.length), used(other.used)
+     {
+          other.slab = PoolSlab();
+          other.length = 0;
+          other.used = 0;
+     }
+
+     PooledBuffer& operator=(PooledBuffer&& other)
+     {
+          std::swap(pool, other.pool);
+          std::swap(slab, other.slab);
+          std::swap(length, other.length);
+          std::swap(used, other.used);
+          return *this;
+     }
+
+     PooledBuffer(const PooledBuffer&) = delete;
+     PooledBuffer& operator=(const PooledBuffer&) = delete;
+
+     char* data() { return slab.data; }
+     const char* data() const { return slab.data; }
+     size_t size() const { return length; }
+     size_t capacity() const { return slab.capacity; }
+     void resize(size_t newLength) { length = newLength; used = std::max(used, newLength); } // must stay within capacity()
+
+private:
+     BufferPool* pool;
+     PoolSlab slab;
+     size_t length;
+     size_t used; // the most length has ever been, all of which gets wiped on return
+};
+
+//===============================================================================
+
+class BufferPool
+{
+public:
+     std::atomic<uint64_t> borrows{0};
+     std::atomic<uint64_t> reuses{0};          // borrows served from the free list
+     std::atomic<uint64_t> slabAllocations{0}; // borrows that had to go to the OS
+     std::atomic<uint64_t> hugePageSlabs{0};   // slabs backed by MAP_HUGETLB
+
+     BufferPool() : hugePages(false) {}
+
+     ~BufferPool()
+     {
+          for(auto& sizeClass : freeSlabs)
+               for(PoolSlab& slab : sizeClass.second)
+                    freeSlab(slab);
+     }
+
+     BufferPool(const BufferPool&) = delete;
+     BufferPool& operator=(const BufferPool&) = delete;
+
+     void useHugePages(bool on)
+     {
+          std::lock_guard<std::mutex> lock(poolLock);
+          hugePages = on;
+     }
+
+     // Hands out a buffer of size bytes with at least that much capacity.
+     PooledBuffer borrow(size_t size)
+     {
+          borrows++;
+
+          size_t capacity;
+          bool huge;
+
+          {
+               std::lock_guard<std::mutex> lock(poolLock);
+
+               huge = hugePages;
+               capacity = classSize(size, huge);
+
+               std::vector<PoolSlab>& sizeClass = freeSlabs[capacity];
+
+               if(!sizeClass.empty())
+               {
+                    PoolSlab slab = sizeClass.back();
+                    sizeClass.pop_back();
+                    reuses++;
+                    return PooledBuffer(this, slab, size);
+               }
+          }
+
+          slabAllocations++;
+          return PooledBuffer(this, allocateSlab(capacity, huge), size);
+     }
+
+     // Takes a slab back, zeroing the first used bytes, which is everything a
+     // borrower may have written to.
+     void giveBack(PoolSlab slab, size_t used)
+     {
+          explicit_bzero(slab.data, std::min(used, slab.capacity));
+
+          std::lock_guard<std::mutex> lock(poolLock);
+
+          std::vector<PoolSlab>& sizeClass = freeSlabs[slab.capacity];
+
+          if(sizeClass.size() < maxFreePerClass)
+               sizeClass.push_back(slab);
+          else
+               freeSlab(slab);
+     }
+
+private:
+     static const size_t alignment = 64;
+     static const size_t minSlabSize = 4096;
+     static const size_t hugePageSize = 2 * 1024 * 1024;
+     static const size_t maxFreePerClass = 8;
+
+     static size_t classSize(size_t size, bool huge)
+     {
+          size_t capacity = huge ? hugePageSize : minSlabSize;
+
+          while(capacity < size)
+               capacity *= 2;
+
+          return capacity;
+     }
+
+     PoolSlab allocateSlab(size_t capacity, bool huge)
+     {
+          PoolSlab slab;
+          slab.capacity = capacity;
+
+          if(huge)
+          {
+               void* memory = mmap(nullptr, capacity, PROT_READ | PROT_WRITE,
+                                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+
+               if(memory != MAP_FAILED)
+                    hugePageSlabs++;
+               else
+               {
+                    memory = mmap(nullptr, capacity, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+                    if(memory != MAP_FAILED)
+                         madvise(memory, capacity, MADV_HUGEPAGE); // no reserved huge pages, ask for THP instead
+               }
+
+               if(memory != MAP_FAILED)
+               {
+                    slab.data = (char*) memory;
+                    slab.mapped = true;
+                    return slab;
+               }
+          }
+
+          slab.data = (char*) aligned_alloc(alignment, capacity);
+
+          if(slab.data == nullptr)
+               throw std::bad_alloc();
+
+          return slab;
+     }
+
+     static void freeSlab(PoolSlab& slab)
+     {
+          if(slab.mapped)
+               munmap(slab.data, slab.capacity);
+          else
+               free(slab.data);
+     }
+
+     std::mutex poolLock; // guards freeSlabs and hugePages
+     std::map<size_t, std::vector<PoolSlab>> freeSlabs; // capacity -> idle slabs
+     bool hugePages;
+};
+
+extern BufferPool bufferPool; // defined in des.cpp
+
+//===============================================================================
+
+inline PooledBuffer::~PooledBuffer()
+{
+     if(slab.data != nullptr)
+          pool->giveBack(slab, used);
+}
+
+//===============================================================================
+// Shared-memory ring
+//
+// "des -s [key] [ring name] [slot count]" creates a POSIX shared memory object
+// holding a single-producer/single-consumer ring of fixed-size slots and serves
+// it until SIGINT/SIGTERM. A co-located client maps the same object
+// (shmRingAttach) and, for each message:
+//
+//      shmRingAcquire  - get the next free slot and write the plaintext (or
+//                        ciphertext) straight into it
+//      shmRingSubmit   - publish it with its direction and length
+//      shmRingWait     - sleep until the worker has transformed it in place
+//      shmRingRelease  - hand the slot back once the result has been read
+//
+// When the worker is stopped it sets the header's closed word and fails every
+// slot still waiting, so shmRingWait returns false instead of sleeping forever,
+// and shmRingAcquire stops handing out slots. shmRingWait also takes an optional
+// timeout for a worker that dies without getting to shut down.
+//
+// The worker pads each message with '0's to a multiple of 8, the same as main()
+// does for files, and runs it through the block engine with the key given on
+// the command line. Both sides sleep on futexes in the shared mapping (head for
+// the worker, each slot's state for the client), so an idle ring costs nothing.
+// One ring serves one client; run a ring per client process.
+
+const uint32_t shmRingMagic = 0x44455352; // "DESR"
+const uint32_t shmSlotSize = 4096;         // payload bytes per slot
+
+const uint32_t slotFree = 0;
+const uint32_t slotRequest = 1;
+const uint32_t slotDone = 2;
+const uint32_t slotFailed = 3; // the worker shut down before getting to it
+
+struct ShmRingHeader
+{
+     std::atomic<uint32_t> magic;        // set last, once the ring is ready to use
+     std::atomic<uint32_t> closed;       // set once the worker has stopped serving
+     uint32_t slotCount;
+     uint32_t slotSize;
+     alignas(64) std::atomic<uint32_t> head; // slots submitted, only the client writes it
+     alignas(64) std::atomic<uint32_t> tail; // slots transformed, only the worker writes it
+};
+
+struct alignas(64) ShmRingSlot
+{
+     std::atomic<uint32_t> state;
+     uint32_t mode;   // 0 = encrypt, 1 = decrypt
+     uint32_t length; // bytes in data; the worker rounds it up to whole blocks
+};
+
+struct ShmRing
+{
+     ShmRingHeader* header = nullptr;
+     size_t mappedLength = 0;
+};
+
+//===============================================================================
+// Async API
+//
+// A DesExecutor owns one background thread that runs queued jobs in order.
+// transformAsync returns an awaitable: buffers no larger than inlineThreshold
+// are transformed right away without suspending, anything bigger is split into
+// chunkSize pieces that are queued one at a time, so other work posted to the
+// same executor gets a turn between chunks. When the last chunk is done the
+// awaiting coroutine is resumed through resumeOn (hand it to your event loop)
+// or, if resumeOn is empty, directly on the executor thread.
+//
+// The buffer is transformed in place and its length must be a multiple of 8
+// (pad it the same way main() does). The buffer has to stay alive until the
+// co_await returns. co_await yields true when every block was transformed and
+// false when the DesCancelToken was tripped first, in which case only the
+// leading chunks were transformed. A key that isn't 8 characters, or a length
+// that isn't whole blocks, throws invalid_argument from transformAsync itself.
+
+class DesExecutor
+{
+public:
+     DesExecutor() : stopping(false)
+     {
+          worker = std::thread([this] { run(); });
+     }
+
+     ~DesExecutor() // runs whatever is still queued so no coroutine is left suspended
+     {
+          {
+               std::lock_guard<std::mutex> lock(queueLock);
+               stopping = true;
+          }
+          queueReady.notify_one();
+          worker.join();
+     }
+
+     DesExecutor(const DesExecutor&) = delete;
+     DesExecutor& operator=(const DesExecutor&) = delete;
+
+     void post(std::function<void()> job)
+     {
+          {
+               std::lock_guard<std::mutex> lock(queueLock);
+               jobs.push_back(std::move(job));
+          }
+          queueReady.notify_one();
+     }
+
+private:
+     void run()
+     {
+          for(;;)
+          {
+               std::function<void()> job;
+               {
+                    std::unique_lock<std::mutex> lock(queueLock);
+                    queueReady.wait(lock, [this] { return stopping || !jobs.empty(); });
+
+                    if(jobs.empty())
+                         return; // stopping and nothing left to do
+
+                    job = std::move(jobs.front());
+                    jobs.pop_front();
+               }
+               job();
+          }
+     }
+
+     std::mutex queueLock;
+     std::condition_variable queueReady;
+     std::deque<std::function<void()>> jobs;
+     bool stopping;
+     std::thread worker;
+};
+
+//===============================================================================
+
+struct DesCancelToken
+{
+     std::atomic<bool> cancelled{false};
+
+     void cancel() { cancelled.store(true, std::memory_order_relaxed); }
+     bool isCancelled() const { return cancelled.load(std::memory_order_relaxed); }
+};
+
+//===============================================================================
+
+struct DesAsyncOptions
+{
+     size_t chunkSize = 64 * 1024;        // bytes handed to the engine per queued job (rounded down to whole blocks)
+     size_t inlineThreshold = 4 * 1024;   // buffers this small are transformed without suspending
+     DesCancelToken* cancelToken = nullptr;
+     std::function<void(std::coroutine_handle<>)> resumeOn; // empty = resume on the executor thread
+};
+
+//===============================================================================
+
+class DesTransformAwaitable
+{
+public:
+     DesTransformAwaitable(DesExecutor& executor, char* data, size_t length,
+                           std::string key, int mode, DesAsyncOptions options)
+          : executor(executor), data(data), numBlocks(length / 8), nextBlock(0),
+            options(std::move(options)), completed(false)
+     {
+          requireValidKey(key);
+
+          if(length % 8 != 0) // a tail we can't encrypt must not come back looking done
+               throw std::invalid_argument("The buffer length must be a multiple of 8. Pad it before transforming.");
+
+          getKeySchedule(key, mode, subKeys); // once for the whole buffer, not per chunk
+
+          chunkBlocks = this->options.chunkSize / 8;
+          if(chunkBlocks == 0)
+               chunkBlocks = 1;
+     }
+
+     ~DesTransformAwaitable()
+     {
+          wipeKeySchedule(subKeys);
+     }
+
+     bool await_ready()
+     {
+          if(numBlocks * 8 > options.inlineThreshold)
+               return false;
+
+          if(options.cancelToken == nullptr || !options.cancelToken->isCancelled())
+          {
+               transformBlocks(data, numBlocks, subKeys);
+               completed = true;
+          }
+
+          return true;
+     }
+
+     void await_suspend(std::coroutine_handle<> handle)
+     {
+          caller = handle;
+          executor.post([this] { runChunk(); });
+     }
+
+     bool await_resume() const
+     {
+          return completed;
+     }
+
+private:
+     void runChunk()
+     {
+          if(options.cancelToken != nullptr && options.cancelToken->isCancelled())
+          {
+               finish();
+               return;
+          }
+
+          size_t count = std::min(chunkBlocks, numBlocks - nextBlock);
+
+          transformBlocks(data + nextBlock * 8, count, subKeys);
+          nextBlock += count;
+
+          if(nextBlock < numBlocks)
+               executor.post([this] { runChunk(); }); // requeue so other jobs can run in between
+          else
+          {
+               completed = true;
+               finish();
+          }
+     }
+
+     void finish()
+     {
+          if(options.resumeOn)
+               options.resumeOn(caller);
+          else
+               caller.resume();
+     }
+
+     DesExecutor& executor;
+     char* data;
+     size_t numBlocks;
+     size_t nextBlock;
+     size_t chunkBlocks;
+     std::string subKeys[16];
+     DesAsyncOptions options;
+     bool completed;
+     std::coroutine_handle<> caller;
+};
+
+//===============================================================================
+
+inline DesTransformAwaitable transformAsync(DesExecutor& executor, char* data, size_t length,
+                                            std::string key, int mode, DesAsyncOptions options = {})
+{
+     return DesTransformAwaitable(executor, data, length, key, mode, std::move(options));
+}
+
+//===============================================================================
+// Stream adaptor
+//
+// DesStreamBuf sits in front of another streambuf: bytes written through it
+// are encrypted, bytes read through it are decrypted. Writes collect in a
+// pooled buffer and go to the engine and the underlying streambuf a whole
+// buffer of blocks at a time. Reads pull a buffer's worth from the underlying
+// streambuf and decrypt every complete block in one engine call. The
+// constructor throws invalid_argument for a key that isn't 8 characters.
+//
+// close() (or the destructor) ends the stream with PKCS#5 padding: 1 to 8
+// bytes, each holding the pad length, so the reader can strip exactly what was
+// added. That means a stream isn't interchangeable with main()'s files, whose
+// '0' padding can't be told apart from the data. The read side holds back the
+// last block until the underlying streambuf runs dry, then strips the padding;
+// if the stream doesn't end in valid padding (wrong key, truncated, not written
+// by close()) underflow throws runtime_error: an istream turns it into badbit,
+// code reading the streambuf directly (istreambuf_iterator) gets the exception.
+//
+//      ofstream file("log.des", ios::binary);
+//      DesStreamBuf cipher(file.rdbuf(), "8charkey");
+//      ostream out(&cipher);
+//      out << "hello" << endl;
+//      cipher.close();
+
+class DesStreamBuf : public std::streambuf
+{
+public:
+     DesStreamBuf(std::streambuf* underlying, std::string key, size_t bufferSize = 64 * 1024)
+          : underlying(underlying), closed(false), readCarryStart(0), readCarry(0), readEof(false)
+     {
+          requireValidKey(key);
+
+          capacity = std::max(bufferSize / 8 * 8, (size_t) 16);
+
+          getKeySchedule(key, 0, encryptKeys);
+          getKeySchedule(key, 1, decryptKeys);
+
+          writeBuffer = bufferPool.borrow(capacity + 8); // + 8 so close() can pad in place
+          readBuffer = bufferPool.borrow(capacity + 8);
+
+          setp(writeBuffer.data(), writeBuffer.data() + capacity);
+          setg(readBuffer.data(), readBuffer.data(), readBuffer.data());
+     }
+
+     ~DesStreamBuf()
+     {
+          close();
+
+          wipeKeySchedule(encryptKeys);
+          wipeKeySchedule(decryptKeys);
+     }
+
+     // Ends the written stream: pads the trailing partial block (a whole block
+     // of padding if there is none), writes it out and flushes the underlying
+     // streambuf. Writing after close() fails. Returns false if the underlying
+     // write failed.
+     bool close()
+     {
+          if(closed)
+               return true;
+
+          closed = true;
+
+          if(!flushBlocks())
+               return false;
+
+          size_t leftover = pptr() - pbase();
+
+          memset(pptr(), 8 - leftover, 8 - leftover);
+          transformBlocks(pbase(), 1, encryptKeys);
+
+          setp(nullptr, nullptr); // nothing more goes in
+
+          if(underlying->sputn(writeBuffer.data(), 8) != 8)
+               return false;
+
+          return underlying->pubsync() == 0;
+     }
+
+protected:
+     int_type overflow(int_type ch) override
+     {
+          if(closed || !flushBlocks())
+               return traits_type::eof();
+
+          if(!traits_type::eq_int_type(ch, traits_type::eof()))
+          {
+               *pptr() = traits_type::to_char_type(ch);
+               pbump(1);
+          }
+
+          return traits_type::not_eof(ch);
+     }
+
+     // Writes out every whole block. Up to 7 bytes stay buffered: a partial
+     // block can't be encrypted without padding it, and padding ends the
+     // stream, so only close() sends them.
+     int sync() override
+     {
+          if(!flushBlocks())
+               return -1;
+
+          return underlying->pubsync();
+     }
+
+     int_type underflow() override
+     {
+          if(gptr() < egptr())
+               return traits_type::to_int_type(*gptr());
+
+          char* base = readBuffer.data();
+          size_t filled = readCarry;
+
+          memmove(base, base + readCarryStart, readCarry); // the blocks held back last time
+
+          while(filled < 16 && !readEof) // need a block to hand out besides the one held back
+          {
+               std::streamsize got = underlying->sgetn(base + filled, capacity - filled);
+
+               if(got <= 0)
+                    readEof = true;
+               else
+                    filled += got;
+          }
+
+          size_t handOut;
+
+          if(!readEof)
+          {
+               handOut = filled / 8 * 8 - 8; // the last block might be the padding
+               transformBlocks(base, handOut / 8, decryptKeys);
+          }
+          else
+          {
+               if(filled % 8 != 0)
+                    throw std::runtime_error("DesStreamBuf: the stream does not end on a block boundary");
+
+               if(filled == 0)
+                    return traits_type::eof();
+
+               transformBlocks(base, filled / 8, decryptKeys);
+
+               unsigned char pad = base[filled - 1];
+               bool valid = pad >= 1 && pad <= 8;
+
+               for(size_t i = filled - pad; valid && i < filled; i++)
+                    valid = (unsigned char) base[i] == pad;
+
+               if(!valid)
+                    throw std::runtime_error("DesStreamBuf: bad padding at the end of the stream. Is the key right?");
+
+               handOut = filled - pad;
+          }
+
+          readCarryStart = handOut;
+          readCarry = filled - handOut;
+
+          if(readEof)
+               readCarry = 0; // the padding, already checked
+
+          if(handOut == 0)
+               return traits_type::eof();
+
+          setg(base, base, base + handOut);
+
+          return traits_type::to_int_type(*gptr());
+     }
+
+private:
+     // Encrypts and writes every whole block in the put area, keeping the
+     // partial block (if any) at the front for the next round.
+     bool flushBlocks()
+     {
+          size_t pending = pptr() - pbase();
+          size_t whole = pending / 8 * 8;
+
+          if(whole > 0)
+          {
+               transformBlocks(pbase(), whole / 8, encryptKeys);
+
+               if(underlying->sputn(pbase(), whole) != (std::streamsize) whole)
+                    return false;
+
+               memmove(writeBuffer.data(), pbase() + whole, pending - whole);
+               setp(writeBuffer.data(), writeBuffer.data() + capacity);
+               pbump(pending - whole);
+          }
+
+          return true;
+     }
+
+     std::streambuf* underlying;
+     std::string encryptKeys[16];
+     std::string decryptKeys[16];
+     size_t capacity; // bytes of data per buffer, a multiple of 8
+     PooledBuffer writeBuffer;
+     PooledBuffer readBuffer;
+     bool closed;           // close() has padded the end of the written stream
+     size_t readCarryStart; // where the still-encrypted held-back bytes start in readBuffer
+     size_t readCarry;      // and how many there are
+     bool readEof;
+};
+
+#endif // DES_H
@@ -0,0 +1,112 @@
+// File Name: async_stream.cpp
+// Program Description: Shows the two in-process ways into the engine. Writes a few lines through a
+//                      DesStreamBuf into an encrypted file and reads them back, then encrypts a
+//                      buffer from a coroutine with transformAsync and decrypts it again.
+//
+//                      g++ -std=c++20 -O2 -pthread -DDES_LIBRARY des.cpp examples/async_stream.cpp -o async_stream
+//
+//                      async_stream 8charkey notes.des
+
+#include <iostream>
+#include <fstream>
+#include <future>
+#include "../des.h"
+
+using namespace std;
+
+// Just enough of a coroutine type to co_await from: it starts right away and
+// reports how it finished through a promise.
+
+struct DemoTask
+{
+     struct promise_type
+     {
+          promise<bool> result;
+
+          DemoTask get_return_object() { return DemoTask{result.get_future()}; }
+          suspend_never initial_suspend() { return {}; }
+          suspend_never final_suspend() noexcept { return {}; }
+          void return_value(bool ok) { result.set_value(ok); }
+          void unhandled_exception() { result.set_exception(current_exception()); }
+     };
+
+     future<bool> finished;
+};
+
+//===============================================================================
+
+DemoTask roundTrip(DesExecutor& executor, string key, string& buffer)
+{
+     DesAsyncOptions options;
+     options.chunkSize = 16 * 1024; // small chunks so the executor switches between jobs
+
+     if (!co_await transformAsync(executor, &buffer[0], buffer.size(), key, 0, options))
+          co_return false;
+
+     co_return co_await transformAsync(executor, &buffer[0], buffer.size(), key, 1, options);
+}
+
+//===============================================================================
+
+int main(int argc, char** argv)
+{
+     if (argc != 3)
+     {
+          cout << "Please use the form: async_stream [key] [encrypted file]" << endl;
+          return 1;
+     }
+
+     string key = argv[1];
+
+     try
+     {
+          {
+               ofstream file(argv[2], ios::binary);
+               DesStreamBuf cipher(file.rdbuf(), key);
+               ostream out(&cipher);
+
+               out << 42 << " " << 123 << endl;
+               out << "hello from DesStreamBuf" << endl;
+
+               if (!cipher.close())
+               {
+                    cout << "Could not write " << argv[2] << endl;
+                    return 1;
+               }
+          }
+
+          ifstream file(argv[2], ios::binary);
+          DesStreamBuf plain(file.rdbuf(), key);
+          istream in(&plain);
+
+          int a, b;
+          string line;
+
+          in >> a >> b;
+          in.ignore();
+          getline(in, line);
+
+          if (in.bad())
+          {
+               cout << argv[2] << " did not decrypt cleanly." << endl;
+               return 1;
+          }
+
+          cout << "Read back: " << a << ", " << b << ", \"" << line << "\"" << endl;
+
+          string buffer(256 * 1024, 'x'); // a whole number of blocks, as transformAsync requires
+          string original = buffer;
+
+          DesExecutor executor;
+          bool completed = roundTrip(executor, key, buffer).finished.get();
+
+          cout << "transformAsync round trip " << (completed && buffer == original ? "matches" : "does NOT match") << endl;
+
+          return completed && buffer == original ? 0 : 1;
+     }
+     catch (exception& e) // a bad key, mostly
+     {
+          cout << e.what() << endl;
+          return 1;
+     }
+}
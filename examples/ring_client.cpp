@@ -0,0 +1,107 @@
+// File Name: ring_client.cpp
+// Program Description: Sends a file through a running "des -s" worker's shared-memory ring and writes
+//                      what comes back. The file goes in slot-sized pieces, as many in flight as
+//                      the ring has free slots, and only the last piece is padded, so the output
+//                      is the same as "des -e" (or "des -d") with the worker's key would give.
+//
+//                      g++ -std=c++20 -O2 -pthread -DDES_LIBRARY des.cpp examples/ring_client.cpp -o ring_client
+//
+//                      des -s 8charkey /des_ring 16 &
+//                      ring_client /des_ring -e plain.txt cipher.des
+
+#include <iostream>
+#include <fstream>
+#include <deque>
+#include "../des.h"
+
+using namespace std;
+
+int main(int argc, char** argv)
+{
+     if (argc != 5 || (strcmp(argv[2], "-e") != 0 && strcmp(argv[2], "-d") != 0))
+     {
+          cout << "Please use the form: ring_client [ring name] [-e|-d] [input file] [output file]" << endl;
+          return 1;
+     }
+
+     int mode = strcmp(argv[2], "-d") == 0 ? 1 : 0;
+
+     ifstream input(argv[3], ios::binary);
+     ofstream output(argv[4], ios::binary);
+
+     if (!input || !output)
+     {
+          cout << "Could not open " << (!input ? argv[3] : argv[4]) << endl;
+          return 1;
+     }
+
+     ShmRing ring;
+
+     if (!shmRingAttach(argv[1], ring))
+     {
+          cout << "Could not attach to shared memory ring " << argv[1] << ". Is \"des -s\" running?" << endl;
+          return 1;
+     }
+
+     const timespec workerTimeout = {5, 0}; // a worker that takes this long on one slot is gone
+     const uint32_t pieceSize = ring.header->slotSize; // whole blocks, so only the last piece gets padded
+
+     deque<pair<uint32_t, char*>> inFlight; // submitted slots not yet written out, oldest first
+     bool inputDone = false;
+     bool failed = false;
+
+     while (!inputDone || !inFlight.empty())
+     {
+          uint32_t sequence;
+          char* data = inputDone ? nullptr : shmRingAcquire(ring, sequence);
+
+          if (data != nullptr) // room for another piece, fill it before waiting on anything
+          {
+               input.read(data, pieceSize);
+               uint32_t length = input.gcount();
+
+               if (length < pieceSize)
+                    inputDone = true;
+
+               if (length > 0)
+               {
+                    shmRingSubmit(ring, sequence, mode, length);
+                    inFlight.push_back({sequence, data});
+               }
+
+               continue;
+          }
+
+          if (inFlight.empty()) // nothing to wait for, so the ring is closed rather than full
+          {
+               failed = true;
+               break;
+          }
+
+          uint32_t length;
+
+          sequence = inFlight.front().first;
+          data = inFlight.front().second;
+          inFlight.pop_front();
+
+          bool done = shmRingWait(ring, sequence, length, &workerTimeout);
+
+          if (done)
+               output.write(data, length);
+
+          shmRingRelease(ring, sequence);
+
+          if (!done)
+          {
+               failed = true;
+               break;
+          }
+     }
+
+     if (failed)
+          cout << "The worker on " << argv[1] << " shut down or stopped answering." << endl;
+
+     shmRingDetach(ring);
+
+     return failed ? 1 : 0;
+}